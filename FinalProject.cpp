@@ -5,6 +5,14 @@
 #include <cmath>
 #include <cassert>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <chrono>
 
 using namespace std;
 
@@ -102,34 +110,322 @@ struct GLMatrix3 {
 	}
 };
 
+/********************
+ *
+ * Work-stealing thread pool used to traverse wide parts of the scene graph.
+ * Every worker owns a deque: it pushes and pops tasks at the back and other
+ * threads steal from the front. A thread waiting on a TaskGroup keeps
+ * running tasks instead of blocking, so tasks may spawn and wait on nested
+ * groups without deadlocking.
+ *
+ ********************/
+struct TaskGroup {
+	atomic<int> pending;
+	TaskGroup() : pending(0) {
+	}
+};
+
+class WorkStealingPool {
+	struct Task {
+		function<void()> fn;
+		TaskGroup *group;
+	};
+	struct WorkQueue {
+		mutex lock;
+		deque<Task> tasks;
+	};
+
+	//one queue per worker plus a last one shared by outside threads (main)
+	vector<WorkQueue> queues;
+	vector<thread> workers;
+	atomic<int> queued;
+	atomic<bool> stopping;
+	mutex sleepLock;
+	condition_variable wakeUp;
+
+	static int &threadIndex() {
+		static thread_local int index = -1;
+		return index;
+	}
+
+	size_t ownQueue() const {
+		const int index = threadIndex();
+		return index < 0 ? queues.size() - 1 : index;
+	}
+
+	bool popOwn(size_t q, Task &task) {
+		lock_guard<mutex> guard(queues[q].lock);
+		if ( queues[q].tasks.empty() )
+			return false;
+		task = move(queues[q].tasks.back());
+		queues[q].tasks.pop_back();
+		return true;
+	}
+
+	bool steal(size_t q, Task &task) {
+		for ( size_t i = 1; i < queues.size(); ++i ) {
+			WorkQueue &victim = queues[(q + i) % queues.size()];
+			lock_guard<mutex> guard(victim.lock);
+			if ( !victim.tasks.empty() ) {
+				task = move(victim.tasks.front());
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool runOne(size_t q) {
+		Task task;
+		if ( !popOwn(q, task) && !steal(q, task) )
+			return false;
+		--queued;
+		task.fn();
+		--task.group->pending;
+		return true;
+	}
+
+	void workerLoop(int index) {
+		threadIndex() = index;
+		while ( !stopping ) {
+			if ( runOne(index) )
+				continue;
+			unique_lock<mutex> guard(sleepLock);
+			wakeUp.wait(guard, [this] { return stopping || queued > 0; });
+		}
+	}
+
+public:
+	//the calling thread also runs tasks while waiting, so leave a core for it
+	static unsigned defaultThreadCount() {
+		const unsigned cores = thread::hardware_concurrency();
+		return cores > 1 ? cores - 1 : 0;
+	}
+
+	explicit WorkStealingPool(unsigned threadCount = defaultThreadCount())
+		: queues(threadCount + 1), queued(0), stopping(false) {
+		for ( unsigned i = 0; i < threadCount; ++i )
+			workers.push_back(thread(&WorkStealingPool::workerLoop, this, (int)i));
+	}
+
+	~WorkStealingPool() {
+		{
+			lock_guard<mutex> guard(sleepLock);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for ( size_t i = 0; i < workers.size(); ++i )
+			workers[i].join();
+	}
+
+	size_t workerCount() const {
+		return workers.size();
+	}
+
+	void spawn(TaskGroup &group, function<void()> fn) {
+		Task task = { move(fn), &group };
+		++group.pending;
+		{
+			WorkQueue &q = queues[ownQueue()];
+			lock_guard<mutex> guard(q.lock);
+			q.tasks.push_back(move(task));
+		}
+		{
+			lock_guard<mutex> guard(sleepLock);
+			++queued;
+		}
+		wakeUp.notify_one();
+	}
+
+	void wait(TaskGroup &group) {
+		const size_t q = ownQueue();
+		while ( group.pending > 0 ) {
+			if ( !runOne(q) )
+				this_thread::yield();
+		}
+	}
+
+	//Calls body(chunk) for every chunk in [0, chunks) and waits for all of
+	//them. Chunk 0 runs on the calling thread.
+	template <class Body>
+	void parallelFor(size_t chunks, const Body &body) {
+		TaskGroup group;
+		for ( size_t c = 1; c < chunks; ++c )
+			spawn(group, [&body, c] { body(c); });
+		body(0);
+		wait(group);
+	}
+};
+
+//set up in main(); while null the scene is traversed on a single thread
+WorkStealingPool *scenePool = 0;
+
+//a subtree is only split when every chunk gets at least this many nodes
+static const size_t SCENE_TASK_GRAIN = 256;
+//at most this many chunks per thread are made from one node's children,
+//enough for stealing to even out chunks of unequal cost
+static const size_t SCENE_CHUNKS_PER_THREAD = 4;
+
+/********************
+ *
+ * A single draw call recorded during traversal and submitted to GL later.
+ * A command without vertices links to count other lists (the chunks built
+ * in parallel under a node) that are drawn, in order, at its position.
+ *
+ ********************/
+struct DrawCmd {
+	GLMatrix3 mvp;
+	const Vtx *vertices;
+	GLenum mode;
+	GLsizei count;
+	const vector<DrawCmd> *lists;
+};
+
+//Calls f on every draw call in drawList in draw order, following links.
+template <class F>
+void forEachDrawCmd(const vector<DrawCmd> &drawList, F &f) {
+	for ( size_t i = 0; i < drawList.size(); ++i ) {
+		const DrawCmd &cmd = drawList[i];
+		if ( cmd.vertices ) {
+			f(cmd);
+			continue;
+		}
+		for ( GLsizei l = 0; l < cmd.count; ++l )
+			forEachDrawCmd(cmd.lists[l], f);
+	}
+}
+
+void submitDrawList(const vector<DrawCmd> &drawList) {
+	auto submit = [](const DrawCmd &cmd) {
+		glVertexAttribPointer(ATTRIB_POS, 2, GL_FLOAT, GL_FALSE, sizeof(Vtx), &cmd.vertices[0].x);
+		glVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vtx), &cmd.vertices[0].color);
+		glUniformMatrix3fv(mvpMatrixID, 1, false, cmd.mvp.mat);
+		glDrawArrays(cmd.mode, 0, cmd.count);
+	};
+	forEachDrawCmd(drawList, submit);
+}
+
 /********************
  *
  * Scene Node class used to implement a transformation hierarchy.
+ * A node may only appear once in the graph: it keeps per-frame traversal
+ * state (its subtree size and the draw lists of its parallel chunks).
  *
  ********************/
 class SceneNode {
 public:
 	GLMatrix3 transform;
 	vector<SceneNode*> children;
-	SceneNode() {
+	SceneNode() : subtreeSize(1) {
 		transform.setIdentity();
 	}
-	virtual void draw(const GLMatrix3 &parentTransform) {
-		drawChildren(parentTransform * transform);
+
+	//Appends this subtree's draw calls to drawList in depth-first order and
+	//returns the number of nodes in the subtree. Chunks built in parallel
+	//stay in this node's chunk lists and are linked from drawList, so the
+	//list is only valid until the next buildDrawList on this node.
+	size_t buildDrawList(const GLMatrix3 &parentTransform, vector<DrawCmd> &drawList) {
+		const GLMatrix3 t = parentTransform * transform;
+		DrawCmd cmd;
+		if ( getGeometry(cmd) ) {
+			cmd.mvp = t;
+			cmd.lists = 0;
+			drawList.push_back(cmd);
+		}
+
+		const size_t chunks = planChunks();
+		if ( chunks == 1 ) {
+			size_t nodes = 1;
+			for ( size_t i = 0; i < children.size(); ++i )
+				nodes += children[i]->buildDrawList(t, drawList);
+			return subtreeSize = nodes;
+		}
+
+		chunkLists.resize(chunks - 1);
+		atomic<size_t> nodes(1);
+		scenePool->parallelFor(chunks, [&](size_t c) {
+			vector<DrawCmd> &out = c == 0 ? drawList : chunkLists[c - 1];
+			if ( c > 0 )
+				out.clear();
+			size_t chunkNodes = 0;
+			for ( size_t i = c == 0 ? 0 : chunkEnds[c - 1]; i < chunkEnds[c]; ++i )
+				chunkNodes += children[i]->buildDrawList(t, out);
+			nodes += chunkNodes;
+		});
+
+		DrawCmd link;
+		link.vertices = 0;
+		link.count = chunks - 1;
+		link.lists = &chunkLists[0];
+		drawList.push_back(link);
+		return subtreeSize = nodes;
 	}
-	
+
+	//When a pool is set, update() runs concurrently on sibling subtrees. An
+	//override may only change its own node and its descendants, and should
+	//reach its children through updateChildren().
 	virtual void update(double t) {
-		for ( size_t i = 0; i < children.size(); ++i )
-			children[i]->update(t);
+		updateChildren(t);
 	}
 	
-	void drawChildren(const GLMatrix3 &t) {
-		for ( size_t i = 0; i < children.size(); ++i )
-			children[i]->draw(t);
+	void updateChildren(double t) {
+		const size_t chunks = planChunks();
+		if ( chunks == 1 ) {
+			for ( size_t i = 0; i < children.size(); ++i )
+				children[i]->update(t);
+			return;
+		}
+		scenePool->parallelFor(chunks, [&](size_t c) {
+			for ( size_t i = c == 0 ? 0 : chunkEnds[c - 1]; i < chunkEnds[c]; ++i )
+				children[i]->update(t);
+		});
 	}
 	
 	virtual ~SceneNode() {
 	}
+
+protected:
+	//Shapes fill in the vertices, primitive and vertex count they draw.
+	virtual bool getGeometry(DrawCmd &) const {
+		return false;
+	}
+
+private:
+	//node count measured by the last buildDrawList, used to size chunks
+	size_t subtreeSize;
+	vector<size_t> chunkEnds;
+	vector< vector<DrawCmd> > chunkLists;
+
+	//Splits children into contiguous chunks of about equal subtree size,
+	//storing the end of each in chunkEnds. Returns 1 if the subtree should
+	//be traversed on the calling thread.
+	size_t planChunks() {
+		const size_t n = children.size();
+		if ( !scenePool || n < 2 || subtreeSize < SCENE_TASK_GRAIN * 2 )
+			return 1;
+		const size_t maxChunks = SCENE_CHUNKS_PER_THREAD * (scenePool->workerCount() + 1);
+		const size_t chunks = min(n, min(maxChunks, subtreeSize / SCENE_TASK_GRAIN));
+		chunkEnds.resize(chunks);
+
+		//plenty of children per chunk: split by count instead of visiting
+		//every child for its size
+		if ( n / chunks >= SCENE_TASK_GRAIN ) {
+			for ( size_t c = 0; c < chunks; ++c )
+				chunkEnds[c] = n * (c + 1) / chunks;
+			return chunks;
+		}
+
+		const size_t total = subtreeSize - 1;
+		size_t c = 0, nodes = 0;
+		for ( size_t i = 0; i < n && c + 1 < chunks; ++i ) {
+			nodes += children[i]->subtreeSize;
+			if ( nodes * chunks >= total * (c + 1) )
+				chunkEnds[c++] = i + 1;
+		}
+		while ( c < chunks )
+			chunkEnds[c++] = n;
+		return chunks;
+	}
 };
 
 class RectangleNode : public SceneNode
@@ -157,14 +453,11 @@ class RectangleNode : public SceneNode
 		}
 	}
 
-	virtual void draw(const GLMatrix3 &parentTransform) {
-		const GLMatrix3 &t = parentTransform * transform;
-		glVertexAttribPointer(ATTRIB_POS, 2, GL_FLOAT, GL_FALSE, sizeof(Vtx), &vertices[0].x);
-		glVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vtx), &vertices[0].color);
-		glUniformMatrix3fv(mvpMatrixID, 1, false, t.mat);
-		glDrawArrays(GL_TRIANGLES, 0, sizeof( vertices ) / sizeof( Vtx ) );
-		
-		drawChildren(t);
+	virtual bool getGeometry(DrawCmd &cmd) const {
+		cmd.vertices = vertices;
+		cmd.mode = GL_TRIANGLES;
+		cmd.count = sizeof( vertices ) / sizeof( Vtx );
+		return true;
 	}
 };
 
@@ -183,14 +476,11 @@ class CircleNode : public SceneNode
 			}
 	  }
 	  
-	  virtual void draw(const GLMatrix3 &parentTransform) {
-		const GLMatrix3 &t = parentTransform * transform;
-		glVertexAttribPointer(ATTRIB_POS, 2, GL_FLOAT, GL_FALSE, sizeof(Vtx), &vertices[0].x);
-		glVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vtx), &vertices[0].color);
-		glUniformMatrix3fv(mvpMatrixID, 1, false, t.mat);
-		glDrawArrays(GL_TRIANGLE_FAN, 0, sizeof( vertices ) / sizeof( Vtx ) );
-		
-		drawChildren(t);
+	  virtual bool getGeometry(DrawCmd &cmd) const {
+		cmd.vertices = vertices;
+		cmd.mode = GL_TRIANGLE_FAN;
+		cmd.count = sizeof( vertices ) / sizeof( Vtx );
+		return true;
 	}
 };
 
@@ -213,14 +503,11 @@ class TriangleNode : public SceneNode
 		}
 	}
 
-	virtual void draw(const GLMatrix3 &parentTransform) {
-		const GLMatrix3 &t = parentTransform * transform;
-		glVertexAttribPointer(ATTRIB_POS, 2, GL_FLOAT, GL_FALSE, sizeof(Vtx), &vertices[0].x);
-		glVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vtx), &vertices[0].color);
-		glUniformMatrix3fv(mvpMatrixID, 1, false, t.mat);
-		glDrawArrays(GL_TRIANGLES, 0, sizeof( vertices ) / sizeof( Vtx ) );
-		
-		drawChildren(t);
+	virtual bool getGeometry(DrawCmd &cmd) const {
+		cmd.vertices = vertices;
+		cmd.mode = GL_TRIANGLES;
+		cmd.count = sizeof( vertices ) / sizeof( Vtx );
+		return true;
 	}
 };
 
@@ -250,14 +537,11 @@ class HardRectNode : public SceneNode
 		}
 	}
 
-	virtual void draw(const GLMatrix3 &parentTransform) {
-		const GLMatrix3 &t = parentTransform * transform;
-		glVertexAttribPointer(ATTRIB_POS, 2, GL_FLOAT, GL_FALSE, sizeof(Vtx), &vertices[0].x);
-		glVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vtx), &vertices[0].color);
-		glUniformMatrix3fv(mvpMatrixID, 1, false, t.mat);
-		glDrawArrays(GL_TRIANGLES, 0, sizeof( vertices ) / sizeof( Vtx ) );
-		
-		drawChildren(t);
+	virtual bool getGeometry(DrawCmd &cmd) const {
+		cmd.vertices = vertices;
+		cmd.mode = GL_TRIANGLES;
+		cmd.count = sizeof( vertices ) / sizeof( Vtx );
+		return true;
 	}
 };
 
@@ -322,6 +606,105 @@ void initShader()
 	glDeleteShader( vShader );
 }
 
+#ifdef SCENE_BENCHMARK
+/********************
+ *
+ * Scene traversal benchmark, built instead of the demo with
+ *   g++ -std=c++11 -O2 -pthread -DSCENE_BENCHMARK FinalProject.cpp -lGLEW -lglfw -lGL
+ * Runs buildDrawList and update on synthetic scenes for 1..N threads (N
+ * defaults to the core count, or pass it as the first argument), checks
+ * every draw list against the single-threaded one and reports the time
+ * per frame. No window or GL context is opened.
+ *
+ ********************/
+struct BenchScene {
+	SceneNode root;
+	vector<SceneNode> groups;
+	vector<RectangleNode> leaves;
+
+	BenchScene(size_t groupCount, size_t leavesPerGroup) {
+		groups.resize(groupCount);
+		leaves.reserve(groupCount * leavesPerGroup);
+		for ( size_t g = 0; g < groupCount; ++g ) {
+			groups[g].transform.setRotation(0, 0, g * 0.01f);
+			root.children.push_back(&groups[g]);
+			for ( size_t i = 0; i < leavesPerGroup; ++i ) {
+				leaves.push_back(RectangleNode(1, 1, 0, 0, COLOR_WHITE));
+				leaves.back().transform.setTranslation(g, i);
+				groups[g].children.push_back(&leaves.back());
+			}
+		}
+	}
+};
+
+vector<DrawCmd> flattenDrawList(const vector<DrawCmd> &drawList) {
+	vector<DrawCmd> flat;
+	auto append = [&flat](const DrawCmd &cmd) { flat.push_back(cmd); };
+	forEachDrawCmd(drawList, append);
+	return flat;
+}
+
+bool sameDrawList(const vector<DrawCmd> &a, const vector<DrawCmd> &b) {
+	if ( a.size() != b.size() )
+		return false;
+	for ( size_t i = 0; i < a.size(); ++i ) {
+		if ( a[i].vertices != b[i].vertices || a[i].mode != b[i].mode || a[i].count != b[i].count
+				|| memcmp(a[i].mvp.mat, b[i].mvp.mat, sizeof(a[i].mvp.mat)) != 0 )
+			return false;
+	}
+	return true;
+}
+
+//best time per frame in milliseconds; the first frames let nodes measure
+//their subtree sizes before timing starts
+double timeFrames(SceneNode &root, vector<DrawCmd> &drawList) {
+	GLMatrix3 identity;
+	identity.setIdentity();
+	double best = 1e30;
+	for ( int frame = 0; frame < 22; ++frame ) {
+		const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		root.update(frame);
+		drawList.clear();
+		root.buildDrawList(identity, drawList);
+		const double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if ( frame >= 2 )
+			best = min(best, ms);
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned maxThreads = argc > 1 ? atoi(argv[1]) : thread::hardware_concurrency();
+	if ( maxThreads < 1 )
+		maxThreads = 1;
+
+	const size_t shapes[][2] = { { 600, 500 }, { 100, 1000 }, { 4, 25000 }, { 1, 100000 } };
+	bool allMatch = true;
+	for ( size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); ++s ) {
+		BenchScene scene(shapes[s][0], shapes[s][1]);
+		vector<DrawCmd> drawList;
+
+		scenePool = 0;
+		const double serial = timeFrames(scene.root, drawList);
+		const vector<DrawCmd> reference = flattenDrawList(drawList);
+		printf("%zu x %zu leaves: serial %.2f ms\n", shapes[s][0], shapes[s][1], serial);
+
+		for ( unsigned threads = 2; threads <= maxThreads;
+				threads = threads < maxThreads && threads * 2 > maxThreads ? maxThreads : threads * 2 ) {
+			WorkStealingPool pool(threads - 1);
+			scenePool = &pool;
+			const double ms = timeFrames(scene.root, drawList);
+			const bool match = sameDrawList(reference, flattenDrawList(drawList));
+			allMatch = allMatch && match;
+			printf("  %2u threads: %.2f ms, speedup %.2fx, draw list %s\n",
+					threads, ms, serial / ms, match ? "matches" : "DIFFERS");
+			scenePool = 0;
+		}
+	}
+	return allMatch ? 0 : 1;
+}
+#else
 int main()
 {
 	if ( !glfwInit() ) {
@@ -558,6 +941,11 @@ int main()
 
 	GLfloat camX = 150, camY = 0, camS = 320, camR = 0;
 
+	WorkStealingPool pool;
+	if ( pool.workerCount() > 0 )
+		scenePool = &pool;
+	vector<DrawCmd> drawList;
+
 	do {
 		int width, height;
 		// Get window size (may be different than the requested size)
@@ -633,7 +1021,10 @@ int main()
 		tempMatrix.setIdentity();
 		tempMatrix.setRotation( 0, 0, -camR );
 		modelMatrix *= tempMatrix;
-		root.draw( modelMatrix );
+		root.update( t );
+		drawList.clear();
+		root.buildDrawList( modelMatrix, drawList );
+		submitDrawList( drawList );
         
 		time += 0.02;
 		glUniform1f(timeId, time);
@@ -648,3 +1039,4 @@ int main()
 	glfwTerminate();
 	return 0;
 }
+#endif